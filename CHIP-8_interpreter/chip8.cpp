@@ -1,18 +1,94 @@
 
 #include "chip8.hpp"
 
-Chip8::Chip8(const uint16_t* instructions, uint32_t* pixels, int width, int height)
+const uint8_t Chip8Base::FONT[16*5] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+Chip8Base::Chip8Base(const uint16_t* instructions, uint32_t* pixels, int width, int height, Chip8Memory* memory)
 {
 
-    memcpy(this->M + 0x200, instructions, 4096 - 0x200);
+    if (memory == NULL) {
+        memory = &own_memory;
+    }
+    M = memory->RAM;
+    FRAME = memory->FRAME;
 
-    PC = 0x200;
+    sink = NULL;
 
     PIXELS = pixels;
     this->width = width;
     this->height = height;
     wh_multiplier = width / 64;
 
+    reset(instructions);
+
+}
+
+void Chip8Base::reset(const uint16_t* instructions)
+{
+
+    memset(M, 0, Chip8Memory::RAM_SIZE);
+    memcpy(M, FONT, sizeof(FONT));
+    memcpy(M + 0x200, instructions, Chip8Memory::RAM_SIZE - 0x200);
+
+    PC = 0x200;
+
+    memset(V, 0, sizeof(V));
+    I = 0;
+    DT = 0;
+    ST = 0;
+
+    while (!S.empty()) {
+        S.pop();
+    }
+
+    memset(FRAME, 0, Chip8Memory::FRAME_BYTES);
+    redraw_screen = true;
+
+    if (PIXELS != NULL) {
+        memset(PIXELS, 0, width*height*sizeof(uint32_t));
+    }
+
+    keys = 0;
+
+}
+
+template <typename Quirks>
+Chip8<Quirks>::Chip8(const uint16_t* instructions, uint32_t* pixels, int width, int height, Chip8Memory* memory)
+    : Chip8Base(instructions, pixels, width, height, memory)
+{
+}
+
+template <typename Quirks>
+size_t Chip8<Quirks>::run(size_t cycles)
+{
+
+    // Statically bound, the decoder gets inlined into this loop
+    size_t executed = 0;
+    for (size_t i = 0; i < cycles; i++) {
+        if (execute_cycle()) {
+            executed++;
+        }
+    }
+
+    return executed;
+
 }
 
 #define WHITE (0xFFFFFFFF)
@@ -25,13 +101,16 @@ Chip8::Chip8(const uint16_t* instructions, uint32_t* pixels, int width, int heig
 
 #define VF (V[0xF])
 
+#define KEY_PRESSED(k) ((keys.load() >> ((k) & 0xF)) & 1)
+
 #define NN (CINSTR & 0x00FF)
 #define NNN (CINSTR & 0x0FFF)
 
-void Chip8::execute_cycle()
+template <typename Quirks>
+bool Chip8<Quirks>::execute_cycle()
 {
 
-    const uint16_t CINSTR = (M[PC] << 8) + M[PC + 1];
+    const uint16_t CINSTR = (mem(PC) << 8) + mem(PC + 1);
     inc_PC();
 
     switch ((CINSTR & 0xF000) >> 12) 
@@ -177,12 +256,21 @@ void Chip8::execute_cycle()
                     VX -= VY;
                 } break;
 
-                // Seems not clean!!
                 case 6: 
                 {
                     // Shifts VY right by one and stores the result to VX (VY remains unchanged). VF is set to the value of the least significant bit of VY before the shift.
-                    VF = VX & 1;
-                    VX >>= 1;
+                    // Later interpreters shift VX in place instead, see Quirks::SHIFT_USES_VY.
+                    const uint8_t source = Quirks::SHIFT_USES_VY ? VY : VX;
+                    VX = source >> 1;
+                    VF = source & 1;
+                } break;
+
+                case 0xE:
+                {
+                    // Shifts VY left by one and copies the result to VX. VF is set to the value of the most significant bit of VY before the shift.
+                    const uint8_t source = Quirks::SHIFT_USES_VY ? VY : VX;
+                    VX = source << 1;
+                    VF = source >> 7;
                 } break;
 
                 default:
@@ -212,8 +300,8 @@ void Chip8::execute_cycle()
         // Seems clean
         case 0xB:
         {
-            // Jumps to the address NNN plus V0.
-            PC = V[0] + NNN;
+            // Jumps to the address NNN plus V0. (XNN plus VX with Quirks::JUMP_USES_VX)
+            PC = (Quirks::JUMP_USES_VX ? VX : V[0]) + NNN;
         } break;
 
         // Seems clean
@@ -227,15 +315,26 @@ void Chip8::execute_cycle()
         case 0xD:
         {
             // Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels. Each row of 8 pixels is read as bit-coded starting from memory location I; I value doesnt change after the execution of this instruction. As described above, VF is set to 1 if any screen pixels are flipped from set to unset when the sprite is drawn, and to 0 if that doesnt happen
-            uint16_t draw_x = VX;
-            uint16_t draw_y = VY;
+            uint16_t draw_x = VX % FRAME_WIDTH;
+            uint16_t draw_y = VY % FRAME_HEIGHT;
             size_t bytes_to_read = CINSTR & 0x000F;
 
+            VF = 0;
+
             for (size_t y = 0; y < bytes_to_read; y++) {
                 
-                uint8_t curr_byte = M[I + y];
+                // Only the start position wraps unless Quirks::SPRITE_WRAP
+                if (!Quirks::SPRITE_WRAP && draw_y + y >= FRAME_HEIGHT) {
+                    break;
+                }
+
+                uint8_t curr_byte = mem(I + y);
 
                 for (size_t x = 0; x < 8; x++) {
+                    if (!Quirks::SPRITE_WRAP && draw_x + x >= FRAME_WIDTH) {
+                        break;
+                    }
+
                     if ((curr_byte >> (7 - x)) & 1) {
                         // There is color here
                         Chip8::color_pixel(draw_x + x, draw_y + y, WHITE);
@@ -260,7 +359,7 @@ void Chip8::execute_cycle()
                 case 0x9E:
                 {
                     // Skips the next instruction if the key stored in VX is pressed. (Usually the next instruction is a jump to skip a code block)
-                    if (pressed[VX]) {
+                    if (KEY_PRESSED(VX)) {
                         inc_PC();
                     }
                 } break;
@@ -269,7 +368,7 @@ void Chip8::execute_cycle()
                 case 0xA1:
                 {
                     // Skips the next instruction if the key stored in VX isn't pressed. (Usually the next instruction is a jump to skip a code block)
-                    if (!pressed[VX]) {
+                    if (!KEY_PRESSED(VX)) {
                         inc_PC();
                     }
                 } break;
@@ -295,14 +394,16 @@ void Chip8::execute_cycle()
                 case 0x0A: 
                 {
                     // A key press is awaited, and then stored in VX. (Blocking Operation. All instruction halted until next key event)
-                    VX = 0xFF;
-                    for (uint8_t i = 0; i <= 0xF; i++) {
-                        if (pressed[i]) {
-                            VX = i;
-                        }
-                    }
-                    if (VX == 0xFF) {
+                    const uint16_t held = keys.load();
+                    if (held == 0) {
                         dec_PC();
+                        return false;
+                    } else {
+                        // Highest held key wins
+                        VX = 0xF;
+                        while (!((held >> VX) & 1)) {
+                            VX--;
+                        }
                     }
                 } break;
 
@@ -339,14 +440,14 @@ void Chip8::execute_cycle()
                     // Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
                     int val = VX;
                     
-                    M[I] = val % 10;
+                    mem(I) = val % 10;
                     val /= 10;
-                    M[I + 1] = val % 10;
+                    mem(I + 1) = val % 10;
                     val /= 10;
-                    M[I + 2] = val % 10;
+                    mem(I + 2) = val % 10;
                     val /= 10;
 
-                    swap(M[I], M[I + 2]);
+                    swap(mem(I), mem(I + 2));
                 } break;
 
                 // Seems clean
@@ -354,9 +455,13 @@ void Chip8::execute_cycle()
                 {
                     // Stores V0 to VX (including VX) in memory starting at address I. I is increased by 1 for each value written.
                     for (size_t i = 0; i <= X; i++) {
-                        M[I + i] = V[i];
+                        mem(I + i) = V[i];
+                    }
+                    if (Quirks::LOAD_STORE_INDEX == IndexIncrement::BY_X_PLUS_1) {
+                        I += X + 1;
+                    } else if (Quirks::LOAD_STORE_INDEX == IndexIncrement::BY_X) {
+                        I += X;
                     }
-                    I += X + 1;
                 } break;
 
                 // Seems clean
@@ -364,9 +469,13 @@ void Chip8::execute_cycle()
                 {
                     // Fills V0 to VX (including VX) with values from memory starting at address I. I is increased by 1 for each value written.
                     for (size_t i = 0; i <= X; i++) {
-                        V[i] = M[I + i];
+                        V[i] = mem(I + i);
+                    }
+                    if (Quirks::LOAD_STORE_INDEX == IndexIncrement::BY_X_PLUS_1) {
+                        I += X + 1;
+                    } else if (Quirks::LOAD_STORE_INDEX == IndexIncrement::BY_X) {
+                        I += X;
                     }
-                    I += X + 1;
                 } break;
 
                 default:
@@ -379,52 +488,157 @@ void Chip8::execute_cycle()
 
     }
 
+    return true;
+
 }
 
-void Chip8::color_pixel(uint32_t x, uint32_t y, uint32_t color)
+void Chip8Base::color_pixel(uint32_t x, uint32_t y, uint32_t color)
 {
 
+    // XOR with black changes nothing
+    if (color == BLACK) {
+        return;
+    }
+
+    x %= FRAME_WIDTH; y %= FRAME_HEIGHT;
+
+    uint8_t* curr_byte = &(FRAME[y*(FRAME_WIDTH/8) + x/8]);
+    const uint8_t bit = 0x80 >> (x % 8);
+
+    // Set pixel gets flipped to unset
+    if (*curr_byte & bit) {
+        VF = 1;
+    }
+
+    *curr_byte ^= bit;
+
+    if (PIXELS == NULL) {
+        return;
+    }
+
     x *= wh_multiplier; y *= wh_multiplier;
 
     for (size_t curr_x = x; curr_x < (x + wh_multiplier); curr_x++) {
         for (size_t curr_y = y; curr_y < (y + wh_multiplier); curr_y++) {  
-            uint32_t* curr_pixel = &(PIXELS[(curr_y % height)*width + (curr_x % width)]);
-
-            if (*curr_pixel != ((*curr_pixel) ^ color)) {
-                VF = true;
-            }
-
-            *curr_pixel ^= color;          
+            PIXELS[curr_y*width + curr_x] ^= color;
         }
     }
 
 }
 
-void Chip8::color_pixel_real(uint32_t x, uint32_t y, uint32_t color)
+void Chip8Base::color_pixel_real(uint32_t x, uint32_t y, uint32_t color)
 {
 
+    x %= FRAME_WIDTH; y %= FRAME_HEIGHT;
+
+    uint8_t* curr_byte = &(FRAME[y*(FRAME_WIDTH/8) + x/8]);
+    const uint8_t bit = 0x80 >> (x % 8);
+
+    if (color == BLACK) {
+        *curr_byte &= ~bit;
+    } else {
+        *curr_byte |= bit;
+    }
+
+    if (PIXELS == NULL) {
+        return;
+    }
+
     x *= wh_multiplier; y *= wh_multiplier;
 
     for (size_t curr_x = x; curr_x < (x + wh_multiplier); curr_x++) {
         for (size_t curr_y = y; curr_y < (y + wh_multiplier); curr_y++) {
-            uint32_t* curr_pixel = &(PIXELS[(curr_y % height)*width + (curr_x % width)]);
-
-            *curr_pixel = color;
+            PIXELS[curr_y*width + curr_x] = color;
         }
     }
 
 }
 
-void Chip8::inc_PC()
+void Chip8Base::inc_PC()
 {
 
     PC += 2;
 
 }
 
-void Chip8::dec_PC()
+void Chip8Base::dec_PC()
 {
 
     PC -= 2;
 
 }
+
+void Chip8Base::tick_timers()
+{
+
+    if (DT > 0) {
+        DT--;
+    }
+    if (ST > 0) {
+        ST--;
+    }
+
+}
+
+void Chip8Base::end_frame()
+{
+
+    tick_timers();
+
+    if (sink != NULL) {
+        sink->on_frame(FRAME, FRAME_WIDTH, FRAME_HEIGHT);
+    }
+
+}
+
+template class Chip8<LegacyQuirks>;
+template class Chip8<CosmacQuirks>;
+template class Chip8<Chip48Quirks>;
+template class Chip8<SChipQuirks>;
+
+bool parse_variant(const char* name, Chip8Variant* variant)
+{
+
+    if (strcmp(name, "legacy") == 0) {
+        *variant = Chip8Variant::LEGACY;
+    } else if (strcmp(name, "cosmac") == 0) {
+        *variant = Chip8Variant::COSMAC;
+    } else if (strcmp(name, "chip48") == 0) {
+        *variant = Chip8Variant::CHIP48;
+    } else if (strcmp(name, "schip") == 0) {
+        *variant = Chip8Variant::SCHIP;
+    } else {
+        return false;
+    }
+
+    return true;
+
+}
+
+Chip8Base* create_chip8(Chip8Variant variant, const uint16_t* instructions, uint32_t* pixels, int width, int height, Chip8Memory* memory)
+{
+
+    switch (variant)
+    {
+        case Chip8Variant::COSMAC:
+        {
+            return new Chip8<CosmacQuirks>(instructions, pixels, width, height, memory);
+        }
+
+        case Chip8Variant::CHIP48:
+        {
+            return new Chip8<Chip48Quirks>(instructions, pixels, width, height, memory);
+        }
+
+        case Chip8Variant::SCHIP:
+        {
+            return new Chip8<SChipQuirks>(instructions, pixels, width, height, memory);
+        }
+
+        default:
+        {
+            return new Chip8<LegacyQuirks>(instructions, pixels, width, height, memory);
+        }
+    }
+
+}
@@ -2,28 +2,124 @@
 
 #include <Windows.h>
 #include <stack>
+#include <atomic>
 #include <random>
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "frame_sink_interface.hpp"
+
 using namespace std;
 
-class Chip8
+/* QUIRKS */
+
+enum class IndexIncrement
+{
+    NONE,
+    BY_X,
+    BY_X_PLUS_1
+};
+
+// Original COSMAC VIP interpreter
+struct CosmacQuirks
+{
+    // 8XY6/8XYE shift VY into VX instead of shifting VX in place
+    static constexpr bool SHIFT_USES_VY = true;
+    // How far FX55/FX65 move I
+    static constexpr IndexIncrement LOAD_STORE_INDEX = IndexIncrement::BY_X_PLUS_1;
+    // Sprites wrap around the screen edges instead of being clipped
+    static constexpr bool SPRITE_WRAP = false;
+    // BNNN jumps to XNN + VX instead of NNN + V0
+    static constexpr bool JUMP_USES_VX = false;
+};
+
+// HP48 CHIP-48
+struct Chip48Quirks
+{
+    static constexpr bool SHIFT_USES_VY = false;
+    static constexpr IndexIncrement LOAD_STORE_INDEX = IndexIncrement::BY_X;
+    static constexpr bool SPRITE_WRAP = false;
+    static constexpr bool JUMP_USES_VX = true;
+};
+
+// SUPER-CHIP 1.1
+struct SChipQuirks
+{
+    static constexpr bool SHIFT_USES_VY = false;
+    static constexpr IndexIncrement LOAD_STORE_INDEX = IndexIncrement::NONE;
+    static constexpr bool SPRITE_WRAP = false;
+    static constexpr bool JUMP_USES_VX = true;
+};
+
+// What this interpreter did before quirks were selectable
+struct LegacyQuirks
+{
+    static constexpr bool SHIFT_USES_VY = false;
+    static constexpr IndexIncrement LOAD_STORE_INDEX = IndexIncrement::BY_X_PLUS_1;
+    static constexpr bool SPRITE_WRAP = true;
+    static constexpr bool JUMP_USES_VX = false;
+};
+
+enum class Chip8Variant
+{
+    LEGACY,
+    COSMAC,
+    CHIP48,
+    SCHIP
+};
+
+// Accepts "legacy", "cosmac", "chip48" and "schip"
+bool parse_variant(const char* name, Chip8Variant* variant);
+
+/* MACHINE */
+
+// RAM and native screen in one block, so a batch of machines can live in shared memory
+struct Chip8Memory
+{
+    static const int FRAME_WIDTH = 64;
+    static const int FRAME_HEIGHT = 32;
+    static const int FRAME_BYTES = FRAME_WIDTH*FRAME_HEIGHT/8;
+
+    static const int RAM_SIZE = 4096;
+
+    uint8_t RAM[RAM_SIZE];
+
+    // Native screen, 1 bit per pixel, rows of FRAME_WIDTH/8 bytes, MSB is leftmost
+    uint8_t FRAME[FRAME_BYTES];
+};
+
+// Everything that doesn't depend on the quirks
+class Chip8Base
 {
 public:
 
     /* CODE */
 
-    Chip8(const uint16_t* instructions, uint32_t* pixels, int width, int height);
+    // memory may be NULL to use own_memory
+    Chip8Base(const uint16_t* instructions, uint32_t* pixels, int width, int height, Chip8Memory* memory = NULL);
+    virtual ~Chip8Base() {}
+
+    // Reloads the font and program and clears all other state
+    void reset(const uint16_t* instructions);
 
-    void execute_cycle();
+    // Executes the given number of cycles, returns how many weren't spent waiting in FX0A
+    virtual size_t run(size_t cycles) = 0;
 
     void color_pixel(uint32_t x, uint32_t y, uint32_t color);
     void color_pixel_real(uint32_t x, uint32_t y, uint32_t color);
 
+    // RAM access, addresses wrap to 4 KiB so nothing reaches past this machine's memory
+    uint8_t& mem(uint32_t address) { return M[address & (Chip8Memory::RAM_SIZE - 1)]; }
+
     void inc_PC();
     void dec_PC();
 
+    // Advances DT and ST by one 60 Hz tick of emulated time
+    void tick_timers();
+
+    // Closes one emulated frame, ticks the timers and hands FRAME to the sink
+    void end_frame();
+
     /* DATA */
 
     // Registers
@@ -40,27 +136,21 @@ public:
     // Stack
     stack<uint16_t> S;
 
-    // RAM
-    uint8_t M[4096] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-    };
-
-    // Screen pixels
+    // Font sprites, copied to the start of RAM
+    static const uint8_t FONT[16*5];
+
+    static const int FRAME_WIDTH = Chip8Memory::FRAME_WIDTH;
+    static const int FRAME_HEIGHT = Chip8Memory::FRAME_HEIGHT;
+
+    // RAM and native screen, pointing into own_memory unless placed elsewhere
+    Chip8Memory own_memory;
+    uint8_t* M;
+    uint8_t* FRAME;
+
+    // Receives FRAME once per emulated frame, may be NULL
+    FrameSink* sink;
+
+    // Scaled screen pixels, may be NULL when running headless
     uint32_t* PIXELS;
 
     int width;
@@ -70,8 +160,32 @@ public:
 
     bool redraw_screen;
 
-    // Keyboard
-    bool key_processed;
-    bool pressed[16];
+    // Keyboard, bit N is set while key N is held
+    atomic<uint16_t> keys;
 
 };
+
+// Quirk checks in here are constant expressions, so each variant compiles to its own decoder
+template <typename Quirks>
+class Chip8 : public Chip8Base
+{
+public:
+
+    /* CODE */
+
+    Chip8(const uint16_t* instructions, uint32_t* pixels, int width, int height, Chip8Memory* memory = NULL);
+
+    // Returns false while FX0A is waiting for a key
+    bool execute_cycle();
+
+    size_t run(size_t cycles) override;
+
+};
+
+extern template class Chip8<LegacyQuirks>;
+extern template class Chip8<CosmacQuirks>;
+extern template class Chip8<Chip48Quirks>;
+extern template class Chip8<SChipQuirks>;
+
+// Picks the instantiation once at load time
+Chip8Base* create_chip8(Chip8Variant variant, const uint16_t* instructions, uint32_t* pixels, int width, int height, Chip8Memory* memory = NULL);
@@ -0,0 +1,236 @@
+
+#include <string.h>
+#include <new>
+
+#include "chip8_env.hpp"
+
+Chip8Env::Chip8Env(size_t count, Chip8Variant variant, const uint16_t* instructions,
+                   const char* shared_name, int cycles_per_frame)
+{
+
+    this->cycles_per_frame = cycles_per_frame;
+
+    program.assign(instructions, instructions + (Chip8Memory::RAM_SIZE - 0x200) / sizeof(uint16_t));
+
+    header = NULL;
+    slots = NULL;
+    region = NULL;
+    served = 0;
+
+    const size_t size = sizeof(EnvHeader) + count*sizeof(EnvSlot);
+
+    // Pagefile backed, other processes open it with OpenFileMapping and the same name
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                 (DWORD)((uint64_t)size >> 32), (DWORD)(size & 0xFFFFFFFF), shared_name);
+    if (mapping == NULL) {
+        return;
+    }
+
+    // Would hand us a live environment or a reader's view, which the setup below wipes
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(mapping);
+        mapping = NULL;
+        return;
+    }
+
+    region = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (region == NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+        return;
+    }
+
+    memset(region, 0, size);
+
+    header = new (region) EnvHeader();
+    header->magic = EnvHeader::MAGIC;
+    header->version = EnvHeader::VERSION;
+    header->count = (uint32_t)count;
+    header->slot_size = sizeof(EnvSlot);
+
+    slots = (EnvSlot*)(region + sizeof(EnvHeader));
+
+    // Machines draw and run straight out of their slots
+    begin_write();
+    for (size_t i = 0; i < count; i++) {
+        machines.push_back(create_chip8(variant, program.data(), NULL, Chip8Memory::FRAME_WIDTH, Chip8Memory::FRAME_HEIGHT, &slots[i].memory));
+    }
+    end_write();
+
+}
+
+Chip8Env::~Chip8Env()
+{
+
+    for (size_t i = 0; i < machines.size(); i++) {
+        delete machines[i];
+    }
+
+    if (region != NULL) {
+        UnmapViewOfFile(region);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+
+}
+
+bool Chip8Env::is_open() const
+{
+
+    return region != NULL;
+
+}
+
+void Chip8Env::reset()
+{
+
+    begin_write();
+    for (size_t i = 0; i < machines.size(); i++) {
+        reset_slot(i);
+    }
+    end_write();
+
+}
+
+void Chip8Env::reset(size_t index)
+{
+
+    begin_write();
+    reset_slot(index);
+    end_write();
+
+}
+
+void Chip8Env::step(const uint16_t* keys)
+{
+
+    begin_write();
+
+    for (size_t i = 0; i < machines.size(); i++) {
+
+        EnvSlot& curr_slot = slots[i];
+        if (curr_slot.done) {
+            continue;
+        }
+
+        Chip8Base& curr_machine = *machines[i];
+
+        // The slot always shows the action that produced its observation
+        if (keys != NULL) {
+            curr_slot.keys = keys[i];
+        }
+
+        curr_machine.keys.store(curr_slot.keys);
+        curr_machine.run(cycles_per_frame);
+        curr_machine.end_frame();
+
+        curr_slot.reward = reward_hook ? reward_hook(curr_machine) : 0;
+        curr_slot.done = done_hook ? done_hook(curr_machine) : false;
+
+    }
+
+    end_write();
+
+}
+
+int Chip8Env::serve()
+{
+
+    if (header == NULL) {
+        return NO_REQUEST;
+    }
+
+    const uint64_t requested = header->request.load(std::memory_order_acquire);
+    if (requested == served) {
+        return NO_REQUEST;
+    }
+
+    // Unknown commands are acknowledged without touching the machines
+    int result;
+    switch (header->command.load(std::memory_order_relaxed))
+    {
+        case EnvHeader::STEP:
+        {
+            step(NULL);
+            result = EnvHeader::STEP;
+        } break;
+
+        case EnvHeader::RESET:
+        {
+            reset();
+            result = EnvHeader::RESET;
+        } break;
+
+        case EnvHeader::CLOSE:
+        {
+            result = EnvHeader::CLOSE;
+        } break;
+
+        default:
+        {
+            result = UNKNOWN_COMMAND;
+        } break;
+    }
+
+    served = requested;
+    header->ack.store(requested, std::memory_order_release);
+
+    return result;
+
+}
+
+size_t Chip8Env::size() const
+{
+
+    return machines.size();
+
+}
+
+Chip8Base& Chip8Env::machine(size_t index)
+{
+
+    return *machines[index];
+
+}
+
+EnvSlot& Chip8Env::slot(size_t index)
+{
+
+    return slots[index];
+
+}
+
+void Chip8Env::reset_slot(size_t index)
+{
+
+    machines[index]->reset(program.data());
+    slots[index].keys = 0;
+    slots[index].done = 0;
+    slots[index].reward = 0;
+
+}
+
+// Seqlock writer side, readers retry while the sequence is odd or has moved
+void Chip8Env::begin_write()
+{
+
+    if (header == NULL) {
+        return;
+    }
+
+    header->sequence.store(header->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+}
+
+void Chip8Env::end_write()
+{
+
+    if (header == NULL) {
+        return;
+    }
+
+    header->sequence.store(header->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+}
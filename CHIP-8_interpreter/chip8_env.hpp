@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <functional>
+
+#include "chip8.hpp"
+
+/* SHARED LAYOUT */
+
+// Start of the shared region, followed by count EnvSlots.
+//
+// Reading a consistent observation (seqlock):
+//   do {
+//       s = sequence.load(acquire);        // odd means a step is writing, retry
+//       read the slots;
+//       atomic_thread_fence(acquire);
+//   } while ((s & 1) || sequence.load(relaxed) != s);
+//
+// Driving the env from another process (see Chip8Env::serve):
+//   write keys into the slots and the command, then r = request.fetch_add(1, release) + 1,
+//   and wait until ack.load(acquire) == r. Only write keys while no request is outstanding.
+struct EnvHeader
+{
+    static const uint32_t MAGIC = 0x56453843; // "C8EV"
+    static const uint32_t VERSION = 2;
+
+    enum Command : uint32_t
+    {
+        STEP = 0,
+        RESET = 1,
+        CLOSE = 2
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t slot_size;
+
+    // Odd while slots are being written, even once they're consistent
+    std::atomic<uint64_t> sequence;
+
+    // Bumped by the agent for every command, echoed back in ack once it's done
+    std::atomic<uint64_t> request;
+    std::atomic<uint64_t> ack;
+
+    std::atomic<uint32_t> command;
+    uint32_t pad;
+};
+
+struct EnvSlot
+{
+    // RAM and packed 64x32 screen of the machine, used by it directly
+    Chip8Memory memory;
+
+    // Keypad of the last step, or for the next one when step() isn't given masks
+    uint16_t keys;
+
+    uint8_t done;
+    uint8_t pad;
+
+    float reward;
+};
+
+// A lock-based atomic would keep its lock outside the mapping, invisible to other processes
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "Shared atomics must be lock-free");
+static_assert(sizeof(std::atomic<uint64_t>) == 8 && sizeof(std::atomic<uint32_t>) == 4,
+              "Shared atomics must be plain integers");
+static_assert(sizeof(EnvHeader) == 48, "EnvHeader layout is shared with other processes");
+static_assert(sizeof(EnvSlot) == 4096 + 256 + 8, "EnvSlot layout is shared with other processes");
+
+/* ENVIRONMENT */
+
+// Steps a batch of machines one frame at a time for agents and test harnesses.
+// Observations live in a named file mapping, so a local process can read them without copies.
+class Chip8Env
+{
+public:
+
+    typedef std::function<float(const Chip8Base&)> RewardHook;
+    typedef std::function<bool(const Chip8Base&)> DoneHook;
+
+    /* CODE */
+
+    // shared_name may be NULL for a mapping only this process sees.
+    // Fails, see is_open(), if a mapping with that name already exists.
+    Chip8Env(size_t count, Chip8Variant variant, const uint16_t* instructions,
+             const char* shared_name = NULL, int cycles_per_frame = 10);
+    ~Chip8Env();
+
+    // Owns the machines and the mapping
+    Chip8Env(const Chip8Env&) = delete;
+    Chip8Env& operator=(const Chip8Env&) = delete;
+
+    bool is_open() const;
+
+    void reset();
+    void reset(size_t index);
+
+    // keys[i] is the keypad mask for machine i, NULL reads the masks from the slots.
+    // Machines that are done stay frozen until they are reset.
+    void step(const uint16_t* keys);
+
+    // Carries out the agent's pending command, if any, and acknowledges it.
+    // Returns the command handled, UNKNOWN_COMMAND for a value it doesn't know
+    // (acknowledged, nothing run), or NO_REQUEST when nothing was requested.
+    int serve();
+
+    static const int NO_REQUEST = -1;
+    static const int UNKNOWN_COMMAND = -2;
+
+    size_t size() const;
+
+    Chip8Base& machine(size_t index);
+    EnvSlot& slot(size_t index);
+
+    /* DATA */
+
+    // Both run after every step of a machine, unset hooks give 0 and false
+    RewardHook reward_hook;
+    DoneHook done_hook;
+
+private:
+
+    void reset_slot(size_t index);
+
+    void begin_write();
+    void end_write();
+
+    HANDLE mapping;
+    uint8_t* region;
+
+    EnvHeader* header;
+    EnvSlot* slots;
+
+    std::vector<Chip8Base*> machines;
+    std::vector<uint16_t> program;
+
+    int cycles_per_frame;
+
+    // Last request number handled by serve()
+    uint64_t served;
+
+};
@@ -0,0 +1,365 @@
+
+#define _CRT_SECURE_NO_WARNINGS 1
+
+#include <Windows.h>
+#include <string.h>
+#include <assert.h>
+
+#include "frame_sink.hpp"
+
+void FrameSinkList::add(FrameSink* sink)
+{
+
+    sinks.push_back(sink);
+
+}
+
+bool FrameSinkList::empty() const
+{
+
+    return sinks.empty();
+
+}
+
+void FrameSinkList::on_frame(const uint8_t* frame, int width, int height)
+{
+
+    for (size_t i = 0; i < sinks.size(); i++) {
+        sinks[i]->on_frame(frame, width, height);
+    }
+
+}
+
+/* ASYNC */
+
+AsyncFrameWriter::AsyncFrameWriter()
+{
+
+    current.count = 0;
+
+    closing = false;
+    closed = false;
+
+}
+
+AsyncFrameWriter::~AsyncFrameWriter()
+{
+
+    assert(closed && "AsyncFrameWriter subclasses must call close() in their destructor");
+
+}
+
+void AsyncFrameWriter::on_frame(const uint8_t* frame, int width, int height)
+{
+
+    const size_t size = width*height/8;
+
+    // Same picture as last frame, just extend the run
+    if (current.count > 0 && current.width == width && current.height == height &&
+        memcmp(current.frame.data(), frame, size) == 0) {
+        current.count++;
+        return;
+    }
+
+    // Started here rather than in the constructor, once the subclass is fully built
+    if (!encoder.joinable()) {
+        encoder = std::thread(&AsyncFrameWriter::worker, this);
+    }
+
+    if (current.count > 0) {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        space_cv.wait(lock, [this] { return queue.size() < MAX_QUEUED_RUNS; });
+        queue.push_back(std::move(current));
+        queue_cv.notify_one();
+    }
+
+    current.frame.assign(frame, frame + size);
+    current.width = width;
+    current.height = height;
+    current.count = 1;
+
+}
+
+void AsyncFrameWriter::close()
+{
+
+    if (closed) {
+        return;
+    }
+
+    // Nothing was ever queued, finish on this thread
+    if (!encoder.joinable()) {
+        if (current.count > 0) {
+            encode(current.frame.data(), current.width, current.height, current.count);
+            current.count = 0;
+        }
+        finish();
+        closed = true;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (current.count > 0) {
+            queue.push_back(std::move(current));
+            current.count = 0;
+        }
+        closing = true;
+        queue_cv.notify_one();
+    }
+
+    encoder.join();
+    closed = true;
+
+}
+
+void AsyncFrameWriter::worker()
+{
+
+    while (true) {
+
+        Run run;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return !queue.empty() || closing; });
+
+            if (queue.empty()) {
+                break;
+            }
+
+            run = std::move(queue.front());
+            queue.pop_front();
+            space_cv.notify_one();
+        }
+
+        encode(run.frame.data(), run.width, run.height, run.count);
+
+    }
+
+    finish();
+
+}
+
+/* Y4M */
+
+Y4MWriter::Y4MWriter(const char* path)
+{
+
+    file = fopen(path, "wb");
+    header_written = false;
+
+}
+
+Y4MWriter::~Y4MWriter()
+{
+
+    close();
+
+}
+
+bool Y4MWriter::is_open() const
+{
+
+    return file != NULL;
+
+}
+
+void Y4MWriter::encode(const uint8_t* frame, int width, int height, uint32_t count)
+{
+
+    if (file == NULL) {
+        return;
+    }
+
+    // Stream size is fixed by the header, frames of another resolution are dropped
+    if (!header_written) {
+        fprintf(file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n", width, height);
+        luma.resize(width*height);
+        header_written = true;
+    } else if (luma.size() != (size_t)(width*height)) {
+        return;
+    }
+
+    for (int i = 0; i < width*height; i++) {
+        luma[i] = ((frame[i/8] >> (7 - i%8)) & 1) ? 0xFF : 0x00;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        fputs("FRAME\n", file);
+        fwrite(luma.data(), 1, luma.size(), file);
+    }
+
+}
+
+void Y4MWriter::finish()
+{
+
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+
+}
+
+/* PNG */
+
+static uint32_t png_crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+
+    static uint32_t table[256];
+    static bool table_ready = false;
+
+    if (!table_ready) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+            table[n] = c;
+        }
+        table_ready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+
+}
+
+static void put_be32(std::vector<uint8_t>& out, uint32_t value)
+{
+
+    out.push_back((value >> 24) & 0xFF);
+    out.push_back((value >> 16) & 0xFF);
+    out.push_back((value >> 8) & 0xFF);
+    out.push_back(value & 0xFF);
+
+}
+
+static void put_chunk(FILE* file, const char* type, const std::vector<uint8_t>& data)
+{
+
+    std::vector<uint8_t> chunk;
+    put_be32(chunk, (uint32_t)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    put_be32(chunk, png_crc32(chunk.data() + 4, chunk.size() - 4));
+
+    fwrite(chunk.data(), 1, chunk.size(), file);
+
+}
+
+PNGSequenceWriter::PNGSequenceWriter(const char* directory)
+{
+
+    this->directory = directory;
+    index = 0;
+
+    CreateDirectoryA(directory, NULL);
+
+    list = fopen((this->directory + "/frames.ffconcat").c_str(), "w");
+    if (list != NULL) {
+        fputs("ffconcat version 1.0\n", list);
+    }
+
+}
+
+PNGSequenceWriter::~PNGSequenceWriter()
+{
+
+    close();
+
+}
+
+bool PNGSequenceWriter::is_open() const
+{
+
+    return list != NULL;
+
+}
+
+void PNGSequenceWriter::encode(const uint8_t* frame, int width, int height, uint32_t count)
+{
+
+    if (list == NULL) {
+        return;
+    }
+
+    char name[32];
+    sprintf(name, "frame_%06u.png", index++);
+
+    FILE* file = fopen((directory + "/" + name).c_str(), "wb");
+    if (file == NULL) {
+        return;
+    }
+
+    static const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+    fwrite(SIGNATURE, 1, sizeof(SIGNATURE), file);
+
+    // 1-bit grayscale, which is exactly the core's packed layout
+    std::vector<uint8_t> header;
+    put_be32(header, width);
+    put_be32(header, height);
+    header.push_back(1);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    put_chunk(file, "IHDR", header);
+
+    // Every scanline gets filter type 0
+    const size_t row_size = width/8;
+    std::vector<uint8_t> raw;
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), frame + y*row_size, frame + (y + 1)*row_size);
+    }
+
+    // zlib stream made of stored deflate blocks, frames are too small to bother compressing
+    std::vector<uint8_t> data;
+    data.push_back(0x78);
+    data.push_back(0x01);
+
+    size_t offset = 0;
+    do {
+        const size_t remaining = raw.size() - offset;
+        const size_t block = remaining > 0xFFFF ? 0xFFFF : remaining;
+        const bool last = offset + block == raw.size();
+
+        data.push_back(last ? 1 : 0);
+        data.push_back(block & 0xFF);
+        data.push_back((block >> 8) & 0xFF);
+        data.push_back(~block & 0xFF);
+        data.push_back((~block >> 8) & 0xFF);
+        data.insert(data.end(), raw.begin() + offset, raw.begin() + offset + block);
+
+        offset += block;
+    } while (offset < raw.size());
+
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    put_be32(data, (b << 16) | a);
+
+    put_chunk(file, "IDAT", data);
+    put_chunk(file, "IEND", std::vector<uint8_t>());
+
+    fclose(file);
+
+    fprintf(list, "file '%s'\nduration %.6f\n", name, count / 60.0);
+
+}
+
+void PNGSequenceWriter::finish()
+{
+
+    if (list != NULL) {
+        fclose(list);
+        list = NULL;
+    }
+
+}
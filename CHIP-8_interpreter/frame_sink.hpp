@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "frame_sink_interface.hpp"
+
+// Forwards every frame to several sinks, none of them owned
+class FrameSinkList : public FrameSink
+{
+public:
+
+    void add(FrameSink* sink);
+
+    bool empty() const;
+
+    void on_frame(const uint8_t* frame, int width, int height) override;
+
+private:
+
+    std::vector<FrameSink*> sinks;
+
+};
+
+// Collapses runs of identical frames and encodes them on a background thread.
+// The thread starts with the first frame. Subclasses must call close() from their
+// destructor, so the encoder never runs on a half-destroyed object.
+class AsyncFrameWriter : public FrameSink
+{
+public:
+
+    /* CODE */
+
+    AsyncFrameWriter();
+    virtual ~AsyncFrameWriter();
+
+    // Blocks while MAX_QUEUED_RUNS runs are waiting to be encoded
+    void on_frame(const uint8_t* frame, int width, int height) override;
+
+    // Flushes the pending run and waits for the encoder to finish
+    void close();
+
+    /* DATA */
+
+    static const size_t MAX_QUEUED_RUNS = 64;
+
+protected:
+
+    // Runs on the encoder thread, frame was shown for count consecutive frames
+    virtual void encode(const uint8_t* frame, int width, int height, uint32_t count) = 0;
+
+    // Runs on the encoder thread after the last encode
+    virtual void finish() {}
+
+private:
+
+    struct Run
+    {
+        std::vector<uint8_t> frame;
+        int width;
+        int height;
+        uint32_t count;
+    };
+
+    void worker();
+
+    /* DATA */
+
+    // Run being extended by on_frame, only touched by the emulator thread
+    Run current;
+
+    std::deque<Run> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable space_cv;
+    bool closing;
+    bool closed;
+
+    std::thread encoder;
+
+};
+
+// Raw monochrome YUV4MPEG2 stream at 60 fps
+class Y4MWriter : public AsyncFrameWriter
+{
+public:
+
+    Y4MWriter(const char* path);
+    ~Y4MWriter();
+
+    bool is_open() const;
+
+protected:
+
+    void encode(const uint8_t* frame, int width, int height, uint32_t count) override;
+    void finish() override;
+
+private:
+
+    FILE* file;
+    bool header_written;
+    std::vector<uint8_t> luma;
+
+};
+
+// One 1-bit grayscale PNG per distinct frame, plus an ffconcat list holding the durations
+class PNGSequenceWriter : public AsyncFrameWriter
+{
+public:
+
+    PNGSequenceWriter(const char* directory);
+    ~PNGSequenceWriter();
+
+    bool is_open() const;
+
+protected:
+
+    void encode(const uint8_t* frame, int width, int height, uint32_t count) override;
+    void finish() override;
+
+private:
+
+    std::string directory;
+    FILE* list;
+    uint32_t index;
+
+};
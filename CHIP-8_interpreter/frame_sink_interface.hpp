@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+class FrameSink
+{
+public:
+
+    virtual ~FrameSink() {}
+
+    // Called once per emulated frame with the core's own framebuffer, 1 bit per pixel,
+    // rows of width/8 bytes, MSB is leftmost. The pointer is only valid during the call.
+    virtual void on_frame(const uint8_t* frame, int width, int height) = 0;
+
+};
@@ -4,29 +4,58 @@
 #include <SDL.h>
 #include <Windows.h>
 #include <thread>
+#include <chrono>
 
 #include "chip8.hpp"
+#include "frame_sink.hpp"
+#include "telemetry.hpp"
+#include "chip8_env.hpp"
 
 bool running = true;
 const int SS_MULTIPLIER = 20;
 const int SCREEN_WIDTH = SS_MULTIPLIER*64;
 const int SCREEN_HEIGHT = SS_MULTIPLIER*32;
+const char* const WINDOW_TITLE = "CHIP-8 Interpreter";
 
-void timers(uint8_t* DT, uint8_t* ST) 
+// Emulated time is measured in 60 Hz frames, timers tick once per frame
+const int INSTRUCTIONS_PER_FRAME = 10;
+const std::chrono::nanoseconds FRAME_DURATION(1000000000 / 60);
+const uint64_t HEADLESS_DEFAULT_FRAMES = 60*60;
+
+// Idle polls of the shared environment that only yield before sleeping
+const int ENV_SPIN_LIMIT = 10000;
+
+// Speed control, turbo runs unthrottled
+const double SPEED_MULTIPLIERS[] = { 0.25, 0.5, 1, 2, 4, 8, 16 };
+const int SPEED_COUNT = sizeof(SPEED_MULTIPLIERS) / sizeof(SPEED_MULTIPLIERS[0]);
+const int SPEED_NORMAL = 2;
+int speed_index = SPEED_NORMAL;
+bool turbo = false;
+
+// Present only every Nth emulated frame
+const int MAX_FRAME_SKIP = 16;
+int frame_skip = 1;
+
+// Frame timing statistics, F1 shows them in the window title and F2 starts them over
+Telemetry telemetry;
+bool stats_overlay = false;
+
+// SDL timestamp of the oldest keypad change not yet presented
+bool input_pending = false;
+uint32_t input_ticks = 0;
+
+uint64_t elapsed_us(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
 {
 
-    while (running) {
-        
-        if ((*DT) > 0) {
-            (*DT)--;
-        }
-        if ((*ST) > 0) {
-            (*ST)--;
-        }
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
 
-        Sleep(16);
+}
 
-    }
+// Returns 0 when unthrottled
+double speed_multiplier()
+{
+
+    return turbo ? 0 : SPEED_MULTIPLIERS[speed_index];
 
 }
 
@@ -45,34 +74,277 @@ void sounds(uint8_t* ST)
 
 }
 
+// Keypad layout, KEYMAP[N] is the host key for CHIP-8 key N
+SDL_Keycode KEYMAP[16] = {
+    SDLK_x, SDLK_a, SDLK_s, SDLK_d,
+    SDLK_q, SDLK_w, SDLK_e, SDLK_1,
+    SDLK_2, SDLK_3, SDLK_z, SDLK_c,
+    SDLK_4, SDLK_r, SDLK_f, SDLK_v
+};
+
+// Each line of the file is a hex CHIP-8 key followed by an SDL key name, e.g. "7 A".
+// Lines that don't parse are ignored and keep their default. Binding a host key that
+// another CHIP-8 key already uses unbinds it from that key.
+void load_keymap(const char* path)
+{
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned int key;
+        char name[64];
+        if (sscanf(line, "%x %63[^\r\n]", &key, name) != 2 || key > 0xF) {
+            continue;
+        }
+
+        SDL_Keycode code = SDL_GetKeyFromName(name);
+        if (code == SDLK_UNKNOWN) {
+            continue;
+        }
+
+        // keymap_lookup returns the first match, so a host key may only be bound once
+        for (int i = 0; i <= 0xF; i++) {
+            if (KEYMAP[i] == code) {
+                KEYMAP[i] = SDLK_UNKNOWN;
+            }
+        }
+        KEYMAP[key] = code;
+    }
+
+    fclose(file);
+
+}
+
+int keymap_lookup(SDL_Keycode code)
+{
+
+    for (int i = 0; i <= 0xF; i++) {
+        if (KEYMAP[i] == code) {
+            return i;
+        }
+    }
+
+    return -1;
+
+}
+
+// Keys physically held at the end of the last processed frame
+uint16_t held_keys = 0;
+
+// Drains the SDL queue once per frame and publishes the keypad with a single store.
+// Every key pressed during the frame is published even if it was already released,
+// so taps shorter than a frame still reach the core; the release shows up a frame later.
+void process_events(Chip8Base& chip8, SDL_Window* window)
+{
+
+    uint16_t pressed = 0;
+
+    SDL_Event eve;
+    while (SDL_PollEvent(&eve)) {
+        
+        switch (eve.type) 
+        {
+            case SDL_QUIT:
+            {
+                running = false;
+            } break;
+
+            case SDL_KEYDOWN:
+            {
+                int key = keymap_lookup(eve.key.keysym.sym);
+                if (key >= 0) {
+                    // Auto-repeat of a held key changes nothing
+                    const bool changed = !(held_keys & (1 << key));
+                    held_keys |= (1 << key);
+                    pressed |= (1 << key);
+                    if (changed && !input_pending) {
+                        input_pending = true;
+                        input_ticks = eve.key.timestamp;
+                    }
+                    break;
+                }
+
+                // Holding a toggle down must not flip it at the key repeat rate
+                if (eve.key.repeat) {
+                    break;
+                }
+
+                switch (eve.key.keysym.sym) 
+                {
+                    // Speed control
+                    case SDLK_TAB:
+                    {
+                        turbo = !turbo;
+                    } break;
+                    case SDLK_EQUALS:
+                    {
+                        if (speed_index < SPEED_COUNT - 1) {
+                            speed_index++;
+                        }
+                    } break;
+                    case SDLK_MINUS:
+                    {
+                        if (speed_index > 0) {
+                            speed_index--;
+                        }
+                    } break;
+                    case SDLK_PAGEUP:
+                    {
+                        if (frame_skip < MAX_FRAME_SKIP) {
+                            frame_skip++;
+                        }
+                    } break;
+                    case SDLK_PAGEDOWN:
+                    {
+                        if (frame_skip > 1) {
+                            frame_skip--;
+                        }
+                    } break;
+
+                    case SDLK_F1:
+                    {
+                        stats_overlay = !stats_overlay;
+                        if (!stats_overlay) {
+                            SDL_SetWindowTitle(window, WINDOW_TITLE);
+                        }
+                    } break;
+                    case SDLK_F2:
+                    {
+                        telemetry.reset();
+                    } break;
+                }
+            } break;
+
+            case SDL_KEYUP:
+            {
+                int key = keymap_lookup(eve.key.keysym.sym);
+                if (key >= 0) {
+                    const bool changed = (held_keys & (1 << key)) != 0;
+                    held_keys &= ~(1 << key);
+                    if (changed && !input_pending) {
+                        input_pending = true;
+                        input_ticks = eve.key.timestamp;
+                    }
+                }
+            } break;
+        }
+
+    }
+
+    chip8.keys.store(held_keys | pressed);
+
+}
+
+void report_error(bool headless, const char* message)
+{
+
+    if (headless) {
+        fprintf(stderr, "Error: %s\n", message);
+    } else {
+        SDL_ShowSimpleMessageBox(0, "Error", message, NULL);
+    }
+
+}
+
+// Usage: [--rom FILE] [--headless] [--frames N] [--y4m FILE] [--png DIR] [--stats SECONDS]
+//        [--variant legacy|cosmac|chip48|schip] [--env N --shm NAME]
+//
+// --env runs N machines headless in the shared memory region NAME and steps them on
+// request of an external agent until it sends CLOSE, see EnvHeader for the protocol.
+//
+// legacy, the default, keeps this interpreter's original behaviour: 8XY6 shifts VX in place,
+// FX55/FX65 advance I, sprites wrap around the screen and BNNN adds V0. The other variants
+// change how existing ROMs run: cosmac shifts VY and clips sprites; chip48 and schip clip
+// sprites and jump with BXNN, chip48 advances I by X only and schip leaves I unchanged.
 int main(int argc, char** argv)
 {
 
+    const char* rom_path = "CODE.chip8";
+    const char* y4m_path = NULL;
+    const char* png_path = NULL;
+    bool headless = false;
+    uint64_t max_frames = 0;
+    int stats_interval = 0;
+    Chip8Variant variant = Chip8Variant::LEGACY;
+    int env_count = 0;
+    const char* shm_name = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--rom") == 0 && i + 1 < argc) {
+            rom_path = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            max_frames = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--y4m") == 0 && i + 1 < argc) {
+            y4m_path = argv[++i];
+        } else if (strcmp(argv[i], "--png") == 0 && i + 1 < argc) {
+            png_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--variant") == 0 && i + 1 < argc) {
+            if (!parse_variant(argv[++i], &variant)) {
+                fprintf(stderr, "Unknown variant %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--env") == 0 && i + 1 < argc) {
+            env_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        }
+    }
+
+    if (env_count > 0) {
+        if (shm_name == NULL) {
+            fprintf(stderr, "Error: --env needs --shm NAME\n");
+            return EXIT_FAILURE;
+        }
+        headless = true;
+    }
+
+    // Headless runs have nobody to wait for, default to one emulated minute
+    if (headless) {
+        turbo = true;
+        if (max_frames == 0) {
+            max_frames = HEADLESS_DEFAULT_FRAMES;
+        }
+    }
+
     // Initialize randomness
     srand(time(NULL));
     
+    SDL_Window* window = NULL;
+    SDL_Surface* window_surface = NULL;
+    SDL_Surface* our_surface = NULL;
+
     // Initialize window
-    SDL_Init(SDL_INIT_VIDEO);
+    if (!headless) {
+        SDL_Init(SDL_INIT_VIDEO);
 
-    SDL_Window* window = SDL_CreateWindow("CHIP-8 Interpreter",
-                                SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                                SCREEN_WIDTH, SCREEN_HEIGHT,
-                                SDL_WINDOW_SHOWN);
+        window = SDL_CreateWindow(WINDOW_TITLE,
+                                    SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                    SCREEN_WIDTH, SCREEN_HEIGHT,
+                                    SDL_WINDOW_SHOWN);
 
-    SDL_Surface* window_surface = SDL_GetWindowSurface(window);
-    SDL_Surface* our_surface = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0, 0, 0, 0);
+        window_surface = SDL_GetWindowSurface(window);
+        our_surface = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0, 0, 0, 0);
 
-    // Making everything black
-    for (size_t i = 0; i < SCREEN_WIDTH*SCREEN_HEIGHT; i++) {
-        ((uint32_t*)our_surface->pixels)[i] = 0x0;
+        // Making everything black
+        for (size_t i = 0; i < SCREEN_WIDTH*SCREEN_HEIGHT; i++) {
+            ((uint32_t*)our_surface->pixels)[i] = 0x0;
+        }
+        SDL_BlitSurface(our_surface, NULL, window_surface, NULL);
+        SDL_UpdateWindowSurface(window);
     }
-    SDL_BlitSurface(our_surface, NULL, window_surface, NULL);
-    SDL_UpdateWindowSurface(window);
 
     // Load code
-    FILE* software = fopen("CODE.chip8", "r");
+    FILE* software = fopen(rom_path, "rb");
     if (software == NULL) {
-        SDL_ShowSimpleMessageBox(0, "Error", "Couldn't find CODE file", NULL);
+        report_error(headless, "Couldn't find CODE file");
         return EXIT_FAILURE;
     }
 
@@ -81,192 +353,184 @@ int main(int argc, char** argv)
 
     fclose(software);
 
-    Chip8 chip8(instructions, (uint32_t*)our_surface->pixels, SCREEN_WIDTH, SCREEN_HEIGHT);
+    // Serve an external agent instead of running the interactive loop
+    if (env_count > 0) {
+        Chip8Env env(env_count, variant, instructions, shm_name, INSTRUCTIONS_PER_FRAME);
+        if (!env.is_open()) {
+            report_error(headless, "Couldn't create the shared environment, the name may already be in use");
+            return EXIT_FAILURE;
+        }
+
+        printf("Serving %d machines on %s\n", env_count, shm_name);
+        fflush(stdout);
+
+        int idle = 0;
+        while (true) {
+            const int command = env.serve();
+            if (command == EnvHeader::CLOSE) {
+                break;
+            }
+
+            if (command == EnvHeader::STEP || command == EnvHeader::RESET) {
+                idle = 0;
+            } else if (command == Chip8Env::UNKNOWN_COMMAND) {
+                fprintf(stderr, "Ignoring unknown environment command\n");
+                idle = 0;
+            } else if (++idle < ENV_SPIN_LIMIT) {
+                std::this_thread::yield();
+            } else {
+                Sleep(1);
+            }
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    load_keymap("KEYMAP.txt");
+
+    // The only place the variant is looked at, the loop below runs the chosen instantiation
+    Chip8Base* machine = create_chip8(variant, instructions, headless ? NULL : (uint32_t*)our_surface->pixels, SCREEN_WIDTH, SCREEN_HEIGHT);
+    Chip8Base& chip8 = *machine;
+
+    // Recording, both writers may run side by side
+    FrameSinkList recorders;
+    Y4MWriter* y4m = NULL;
+    PNGSequenceWriter* png = NULL;
+    if (y4m_path != NULL) {
+        y4m = new Y4MWriter(y4m_path);
+        if (!y4m->is_open()) {
+            report_error(headless, "Couldn't open Y4M output");
+            delete y4m;
+            return EXIT_FAILURE;
+        }
+        recorders.add(y4m);
+    }
+    if (png_path != NULL) {
+        png = new PNGSequenceWriter(png_path);
+        if (!png->is_open()) {
+            report_error(headless, "Couldn't open PNG output directory");
+            delete png;
+            delete y4m;
+            return EXIT_FAILURE;
+        }
+        recorders.add(png);
+    }
+    if (!recorders.empty()) {
+        chip8.sink = &recorders;
+    }
+
+    std::thread sound;
+    if (!headless) {
+        sound = std::thread(sounds, &chip8.ST);
+    }
 
-    std::thread timer(timers, &chip8.DT, &chip8.ST);
-    std::thread sound(sounds, &chip8.ST);
+    std::chrono::steady_clock::time_point next_frame = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_present = next_frame;
+    std::chrono::steady_clock::time_point last_frame = next_frame;
+    std::chrono::steady_clock::time_point last_stats = next_frame;
+    std::chrono::steady_clock::time_point last_overlay = next_frame;
+    uint64_t frame = 0;
 
     while (running) {
 
-        // Main emulator function, emulate one cycle
-        chip8.execute_cycle();
+        const std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+
+        // Main emulator function, emulate one frame worth of cycles
+        const size_t executed = chip8.run(INSTRUCTIONS_PER_FRAME);
+
+        const std::chrono::steady_clock::time_point executed_at = std::chrono::steady_clock::now();
+        telemetry.instructions.record(executed);
+        telemetry.execute.record(elapsed_us(frame_start, executed_at));
+
+        if (!headless) {
+            process_events(chip8, window);
+            telemetry.events.record(elapsed_us(executed_at, std::chrono::steady_clock::now()));
+        }
+
+        // Timers follow emulated time, not wall time
+        chip8.end_frame();
+        frame++;
+
+        if (max_frames != 0 && frame >= max_frames) {
+            running = false;
+        }
 
-        if (chip8.redraw_screen) {
+        const double speed = speed_multiplier();
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        // Skipped frames keep redraw_screen set, so the next presented frame picks them up.
+        // Unthrottled, presenting is additionally capped at the real 60 Hz.
+        if (!headless && chip8.redraw_screen && frame % frame_skip == 0 &&
+            (speed > 0 || now - last_present >= FRAME_DURATION)) {
             SDL_BlitSurface(our_surface, NULL, window_surface, NULL);
             SDL_UpdateWindowSurface(window);
 
             chip8.redraw_screen = false;
-        }
+            last_present = now;
 
-        SDL_Event eve;
-        while (SDL_PollEvent(&eve)) {
-            
-            switch (eve.type) 
-            {
-                case SDL_QUIT:
-                {
-                    running = false;
-                } break;
+            telemetry.present.record(elapsed_us(now, std::chrono::steady_clock::now()));
 
-                case SDL_KEYDOWN:
-                {
-                    switch (eve.key.keysym.sym) 
-                    {
-                        case SDLK_1: 
-                        {
-                            chip8.pressed[7] = true;
-                        } break;
-                        case SDLK_2:
-                        {
-                            chip8.pressed[8] = true;
-                        } break;
-                        case SDLK_3:
-                        {
-                            chip8.pressed[9] = true;
-                        } break;
-                        case SDLK_4:
-                        {
-                            chip8.pressed[0xC] = true;
-                        } break;
-                        case SDLK_q:
-                        {
-                            chip8.pressed[4] = true;
-                        } break;
-                        case SDLK_w:
-                        {
-                            chip8.pressed[5] = true;
-                        } break;
-                        case SDLK_e:
-                        {
-                            chip8.pressed[6] = true;
-                        } break;
-                        case SDLK_r:
-                        {
-                            chip8.pressed[0xD] = true;
-                        } break;
-                        case SDLK_a:
-                        {
-                            chip8.pressed[1] = true;
-                        } break;
-                        case SDLK_s:
-                        {
-                            chip8.pressed[2] = true;
-                        } break;
-                        case SDLK_d:
-                        {
-                            chip8.pressed[3] = true;
-                        } break;
-                        case SDLK_f:
-                        {
-                            chip8.pressed[0xE] = true;
-                        } break;
-                        case SDLK_z:
-                        {
-                            chip8.pressed[0xA] = true;
-                        } break;
-                        case SDLK_x:
-                        {
-                            chip8.pressed[0] = true;
-                        } break;
-                        case SDLK_c:
-                        {
-                            chip8.pressed[0xB] = true;
-                        } break;
-                        case SDLK_v:
-                        {
-                            chip8.pressed[0xF] = true;
-                        } break;
-                    }
-                } break;
-                case SDL_KEYUP:
-                {
-                    switch (eve.key.keysym.sym) 
-                    {
-                        case SDLK_1:
-                        {
-                            chip8.pressed[7] = false;
-                        } break;
-                        case SDLK_2:
-                        {
-                            chip8.pressed[8] = false;
-                        } break;
-                        case SDLK_3:
-                        {
-                            chip8.pressed[9] = false;
-                        } break;
-                        case SDLK_4:
-                        {
-                            chip8.pressed[0xC] = false;
-                        } break;
-                        case SDLK_q:
-                        {
-                            chip8.pressed[4] = false;
-                        } break;
-                        case SDLK_w:
-                        {
-                            chip8.pressed[5] = false;
-                        } break;
-                        case SDLK_e:
-                        {
-                            chip8.pressed[6] = false;
-                        } break;
-                        case SDLK_r:
-                        {
-                            chip8.pressed[0xD] = false;
-                        } break;
-                        case SDLK_a:
-                        {
-                            chip8.pressed[1] = false;
-                        } break;
-                        case SDLK_s:
-                        {
-                            chip8.pressed[2] = false;
-                        } break;
-                        case SDLK_d:
-                        {
-                            chip8.pressed[3] = false;
-                        } break;
-                        case SDLK_f:
-                        {
-                            chip8.pressed[0xE] = false;
-                        } break;
-                        case SDLK_z:
-                        {
-                            chip8.pressed[0xA] = false;
-                        } break;
-                        case SDLK_x:
-                        {
-                            chip8.pressed[0] = false;
-                        } break;
-                        case SDLK_c:
-                        {
-                            chip8.pressed[0xB] = false;
-                        } break;
-                        case SDLK_v:
-                        {
-                            chip8.pressed[0xF] = false;
-                        } break;
-                    }
-                } break;
+            if (input_pending) {
+                telemetry.latency.record((uint64_t)(SDL_GetTicks() - input_ticks) * 1000);
+                input_pending = false;
             }
+        }
+
+        // Drift is only meaningful while throttled
+        if (speed > 0 && frame > 1) {
+            const int64_t ideal = (int64_t)(FRAME_DURATION.count() / 1000 / speed);
+            telemetry.record_drift((int64_t)elapsed_us(last_frame, frame_start) - ideal);
+        }
+        last_frame = frame_start;
+
+        if (stats_interval > 0 && now - last_stats >= std::chrono::seconds(stats_interval)) {
+            telemetry.dump(stdout);
+            last_stats = now;
+        }
 
+        // Paced on wall time, turbo would otherwise retitle the window thousands of times a second
+        if (stats_overlay && now - last_overlay >= std::chrono::seconds(1)) {
+            char title[160];
+            telemetry.summary(title, sizeof(title));
+            SDL_SetWindowTitle(window, title);
+            last_overlay = now;
         }
 
-        static int sleep_time = 0;
-        if (sleep_time >= 1) {
-            sleep_time--;
+        if (speed > 0) {
+            next_frame += std::chrono::duration_cast<std::chrono::nanoseconds>(FRAME_DURATION / speed);
+
+            // Don't try to catch up after a stall, or on leaving turbo
+            if (now - next_frame > 4*FRAME_DURATION) {
+                next_frame = now;
+            }
+
+            std::this_thread::sleep_until(next_frame);
         } else {
-            sleep_time++;
+            next_frame = now;
         }
-        Sleep(sleep_time);
 
     }
 
-    timer.join();
+    // Waits for the encoder to drain
+    chip8.sink = NULL;
+    delete y4m;
+    delete png;
+
+    if (stats_interval > 0) {
+        telemetry.dump(stdout);
+    }
+
+    if (headless) {
+        delete machine;
+        return EXIT_SUCCESS;
+    }
+
     sound.join();
+    delete machine;
 
+    SDL_FreeSurface(our_surface);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,155 @@
+
+#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "telemetry.hpp"
+
+Histogram::Histogram()
+{
+
+    reset();
+
+}
+
+void Histogram::record(uint64_t value)
+{
+
+    int bucket = 0;
+    for (uint64_t v = value; v != 0 && bucket < BUCKETS - 1; v >>= 1) {
+        bucket++;
+    }
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    samples.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current = maximum.load(std::memory_order_relaxed);
+    while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+
+}
+
+uint64_t Histogram::count() const
+{
+
+    return samples.load(std::memory_order_relaxed);
+
+}
+
+uint64_t Histogram::largest() const
+{
+
+    return maximum.load(std::memory_order_relaxed);
+
+}
+
+double Histogram::mean() const
+{
+
+    const uint64_t n = count();
+    return n == 0 ? 0 : (double)sum.load(std::memory_order_relaxed) / n;
+
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+
+    const uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+
+    const uint64_t target = (uint64_t)(p * n);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen > target || seen == n) {
+            const uint64_t bound = i == 0 ? 0 : ((uint64_t)1 << i) - 1;
+            return bound < largest() ? bound : largest();
+        }
+    }
+
+    return largest();
+
+}
+
+void Histogram::reset()
+{
+
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+    samples = 0;
+    sum = 0;
+    maximum = 0;
+
+}
+
+Telemetry::Telemetry()
+{
+
+    total_drift = 0;
+
+}
+
+void Telemetry::record_drift(int64_t drift_us)
+{
+
+    drift.record(drift_us < 0 ? -drift_us : drift_us);
+    total_drift.fetch_add(drift_us, std::memory_order_relaxed);
+
+}
+
+void Telemetry::dump(FILE* out) const
+{
+
+    struct Row
+    {
+        const char* name;
+        const Histogram* histogram;
+    };
+
+    const Row rows[] = {
+        { "instructions", &instructions },
+        { "execute us", &execute },
+        { "events us", &events },
+        { "present us", &present },
+        { "drift us", &drift },
+        { "latency us", &latency },
+    };
+
+    fprintf(out, "%-14s %10s %10s %10s %10s %10s\n", "", "count", "mean", "p50", "p99", "max");
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        const Histogram& h = *rows[i].histogram;
+        fprintf(out, "%-14s %10llu %10.1f %10llu %10llu %10llu\n", rows[i].name,
+                (unsigned long long)h.count(), h.mean(),
+                (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99),
+                (unsigned long long)h.largest());
+    }
+    fprintf(out, "%-14s %10lld\n", "total drift us", (long long)total_drift.load(std::memory_order_relaxed));
+    fflush(out);
+
+}
+
+void Telemetry::summary(char* buffer, size_t size) const
+{
+
+    snprintf(buffer, size, "exec p99 %lluus | present p99 %lluus | drift p99 %lluus | latency p99 %lluus",
+             (unsigned long long)execute.percentile(0.99), (unsigned long long)present.percentile(0.99),
+             (unsigned long long)drift.percentile(0.99), (unsigned long long)latency.percentile(0.99));
+
+}
+
+void Telemetry::reset()
+{
+
+    instructions.reset();
+    execute.reset();
+    events.reset();
+    present.reset();
+    drift.reset();
+    latency.reset();
+
+    total_drift = 0;
+
+}
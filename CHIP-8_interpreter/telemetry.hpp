@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Lock-free log2 histogram, bucket N counts samples in [2^(N-1), 2^N)
+class Histogram
+{
+public:
+
+    /* CODE */
+
+    Histogram();
+
+    // Safe to call from any thread
+    void record(uint64_t value);
+
+    uint64_t count() const;
+    uint64_t largest() const;
+    double mean() const;
+
+    // Upper bound of the bucket holding the p-th fraction of samples, capped at the largest sample
+    uint64_t percentile(double p) const;
+
+    void reset();
+
+    /* DATA */
+
+    static const int BUCKETS = 32;
+
+private:
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> samples;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maximum;
+
+};
+
+// Per-frame metrics of the main loop, times are in microseconds
+class Telemetry
+{
+public:
+
+    /* CODE */
+
+    Telemetry();
+
+    // Records the signed difference between the actual and ideal frame interval
+    void record_drift(int64_t drift_us);
+
+    // Full table, for periodic dumps
+    void dump(FILE* out) const;
+
+    // One line, for the window title overlay
+    void summary(char* buffer, size_t size) const;
+
+    void reset();
+
+    /* DATA */
+
+    Histogram instructions;
+    Histogram execute;
+    Histogram events;
+    Histogram present;
+    Histogram drift;
+    Histogram latency;
+
+    // Sum of all recorded drift, positive means the emulator is falling behind
+    std::atomic<int64_t> total_drift;
+
+};